@@ -1,3 +1,4 @@
+#define _POSIX_C_SOURCE 200112L // For clock_gettime with -std=c99
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -5,130 +6,726 @@
 #include <string.h>
 #include <malloc.h>
 #include <pthread.h>
+#include <sys/resource.h>
 #include "utility.h" // Including utility header file
+#include "trace.h"
 
 // Define constants for seller counts, concert dimensions, and simulation duration
+// Seller counts can be overridden with -D, e.g. -Dlp_seller_count=64 for benchmarking
+#ifndef hp_seller_count
 #define hp_seller_count 1
+#endif
+#ifndef mp_seller_count
 #define mp_seller_count 3
+#endif
+#ifndef lp_seller_count
 #define lp_seller_count 6
+#endif
 #define total_seller (hp_seller_count + mp_seller_count + lp_seller_count)
 #define concert_row 10
 #define concert_col 10
 #define simulation_duration 60
-#define MAX_CUSTOMERS 100
+
+// Shared state written by different threads is kept on separate cache lines
+// Compile with -Dcache_line_layout=0 to drop the alignment and the padding after each customer line
+#ifndef cache_line_layout
+#define cache_line_layout 1
+#endif
+#define cache_line_size 64
+#ifndef cache_aligned
+#if cache_line_layout
+#define cache_aligned __attribute__((aligned(cache_line_size)))
+#else
+#define cache_aligned
+#endif
+#endif
+
+// Dynamic staffing: compile with -Ddynamic_staffing=1 to let the clock tick
+// controller park and wake sellers within [min, max] per seller type
+// Bounds default to a third and five thirds of the seller count, rounded up, e.g. 2 and 10 for 6
+// sellers, and can be overridden with -D, e.g. -Dlp_seller_min=4
+#ifndef dynamic_staffing
+#define dynamic_staffing 0
+#endif
+#if dynamic_staffing
+#ifndef hp_seller_min
+#define hp_seller_min ((hp_seller_count + 2) / 3)
+#endif
+#ifndef hp_seller_max
+#define hp_seller_max ((5 * hp_seller_count + 2) / 3)
+#endif
+#ifndef mp_seller_min
+#define mp_seller_min ((mp_seller_count + 2) / 3)
+#endif
+#ifndef mp_seller_max
+#define mp_seller_max ((5 * mp_seller_count + 2) / 3)
+#endif
+#ifndef lp_seller_min
+#define lp_seller_min ((lp_seller_count + 2) / 3)
+#endif
+#ifndef lp_seller_max
+#define lp_seller_max ((5 * lp_seller_count + 2) / 3)
+#endif
+#else
+#define hp_seller_min hp_seller_count
+#define hp_seller_max hp_seller_count
+#define mp_seller_min mp_seller_count
+#define mp_seller_max mp_seller_count
+#define lp_seller_min lp_seller_count
+#define lp_seller_max lp_seller_count
+#endif
+#define total_seller_slots (hp_seller_max + mp_seller_max + lp_seller_max)
+#define scale_up_queue_depth 2 // Waiting customers per active seller that triggers a new seller
+#define tat_target_factor 2		// Recent TAT above this many worst-case service times triggers a new seller
+#define tat_smoothing 0.3f		// Weight of the latest tick in the recent TAT average
+
+// Shared tier queue: compile with -Dshared_tier_queue=1 so that all sellers of a type
+// serve one line in arrival order instead of each seller keeping a private line
+#ifndef shared_tier_queue
+#define shared_tier_queue 0
+#endif
+
+// Mixed buy/cancel workload: percent of customers who give up waiting in line after up to
+// max_patience ticks, and percent of seated customers who cancel within max_refund_delay ticks
+#ifndef renege_percent
+#define renege_percent 0
+#endif
+#ifndef refund_percent
+#define refund_percent 0
+#endif
+#define max_patience 10
+#define max_refund_delay 10
+
+// Batched seat commit: compile with -Dbatched_seat_commit=1 so that sellers post finished
+// customers without locking and the main thread seats them all at the next tick boundary
+#ifndef batched_seat_commit
+#define batched_seat_commit 0
+#endif
+#define seat_count (concert_row * concert_col)
+
+// Customers are 32-bit indexes into a customer table per seller type, event ticks and
+// seats are stored in one byte each, see customer_table for the bytes per customer budget
+typedef unsigned char tick_t;
+typedef unsigned char seat_t;
+#define no_tick ((tick_t)0xFF)
+#define no_seat ((seat_t)0xFF)
+#define customer_bytes_budget 24
+#if simulation_duration + max_patience + max_refund_delay >= 0xFF || seat_count >= 0xFF
+#error "ticks and seats must fit in one byte"
+#endif
+
+// Seats hold the owner's seller type and customer index packed into one word, 0 when free
+#define seat_free 0u
+#define max_customers_per_tier 0x3FFFFFFE
+#define seat_owner(tier_no, cust) (((unsigned int)(tier_no) << 30) | ((unsigned int)(cust) + 1))
+#define seat_tier(owner) ((owner) >> 30)
+#define seat_customer(owner) ((int)((owner) & 0x3FFFFFFFu) - 1)
+
+#if hp_seller_min > hp_seller_count || hp_seller_count > hp_seller_max || \
+	mp_seller_min > mp_seller_count || mp_seller_count > mp_seller_max || \
+	lp_seller_min > lp_seller_count || lp_seller_count > lp_seller_max
+#error "seller counts must lie within the [min, max] staffing bounds"
+#endif
 
 // Global variables
-int sim_time;																	// Simulation time
-int N = 5;																		// Number of customers
-int at1[15] = {0}, st1[15] = {0}, tat1[15] = {0}, bt1[15] = {0}, rt1[15] = {0}; // Arrays for storing metrics
-float throughput[3] = {0};														// Array for storing throughput of each seller type
-float avg_rt = 0, avg_tat = 0, cust_served = 0;									// Variables for storing average response time and turnaround time
-char seat_matrix[concert_row][concert_col][5];
-int at_H[MAX_CUSTOMERS] = {0}, tat_H[MAX_CUSTOMERS] = {0}, rt_H[MAX_CUSTOMERS] = {0};
-int at_M[MAX_CUSTOMERS] = {0}, tat_M[MAX_CUSTOMERS] = {0}, rt_M[MAX_CUSTOMERS] = {0};
-int at_L[MAX_CUSTOMERS] = {0}, tat_L[MAX_CUSTOMERS] = {0}, rt_L[MAX_CUSTOMERS] = {0}; // Matrix representing concert seat arrangement
+int sim_time cache_aligned;									 // Simulation time, written by the main thread once per tick
+int N = 5;													 // Number of customers
+unsigned int seat_matrix[concert_row][concert_col] cache_aligned; // Matrix representing concert seat arrangement
+pthread_mutex_t reservation_mutex cache_aligned = PTHREAD_MUTEX_INITIALIZER; // Mutex for reservation process
+long reservation_locks = 0;																	  // Times reservation_mutex was taken, guarded by it
 
 // Thread variables
-pthread_t seller_t[total_seller];												 // Array to store seller threads
-pthread_mutex_t thread_count_mutex = PTHREAD_MUTEX_INITIALIZER;					 // Mutex for controlling access to thread count
-pthread_mutex_t thread_waiting_for_clock_tick_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex for waiting for clock tick
-pthread_mutex_t reservation_mutex = PTHREAD_MUTEX_INITIALIZER;					 // Mutex for reservation process
-pthread_mutex_t thread_completion_mutex = PTHREAD_MUTEX_INITIALIZER;			 // Mutex for thread completion
-pthread_mutex_t condition_mutex = PTHREAD_MUTEX_INITIALIZER;					 // Mutex for condition variable
-pthread_cond_t condition_cond = PTHREAD_COND_INITIALIZER;						 // Condition variable for synchronizing threads
+pthread_t seller_t[total_seller_slots];								 // Array to store seller threads
+pthread_mutex_t thread_completion_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex for thread completion
 
-// Structure for passing arguments to seller threads
-typedef struct sell_arg_struct
+// Seller thread counts
+struct thread_counts_struct
+{
+	pthread_mutex_t mutex; // Mutex for controlling access to thread count
+	int thread_count;	   // Seller threads not yet initialized
+	int active_thread;	   // Seller threads taking part in clock ticks
+} cache_aligned thread_counts = {PTHREAD_MUTEX_INITIALIZER, 0, 0};
+
+// Clock tick barrier, every active seller checks in once per tick
+struct tick_barrier_struct
+{
+	pthread_mutex_t mutex; // Mutex for waiting for clock tick
+	int threads_waiting;   // Sellers done with the current tick
+} cache_aligned tick_barrier = {PTHREAD_MUTEX_INITIALIZER, 0};
+
+// Clock tick broadcast
+struct clock_tick_struct
+{
+	pthread_mutex_t condition_mutex; // Mutex for condition variable
+	pthread_cond_t condition_cond;	 // Condition variable for synchronizing threads
+} cache_aligned clock_tick = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+// Customers of one seller type, stored as structure of arrays indexed by customer
+// Lines are stored back to back, so a customer's line and number follow from the index
+// Each line's slice of every column starts on its own cache line, so sellers serving
+// private lines never write to the same cache line during a tick
+// 13 bytes per column slot, 24 with the columns only allocated for the mixed buy/cancel workload,
+// with few customers per line the padding makes the cost per customer higher
+typedef struct customer_table_struct
+{
+	int count;			  // Customers in the table
+	int slots;			  // Entries in each column, including the padding after every line
+	int line_size;		  // Customers per line
+	int line_stride;	  // Entries per line, line_size rounded up to a whole number of cache lines
+	int slot_bytes;		  // Bytes of one entry across every column
+	tick_t *arrival;	  // Tick the customer joins the line
+	tick_t *service;	  // Ticks the sale takes
+	tick_t *start;		  // Tick service started, no_tick if never served
+	tick_t *finish;		  // Tick the seat was assigned or refused, no_tick if never finished
+	seat_t *seat;		  // Seat index assigned to the customer, no_seat if none
+	int *next;			  // Links of the queue the customer is in
+	int *prev;
+	short *waiting_in;	  // renege_percent only: seller slot whose line the customer waits in, -1 for the shared tier line
+	int *give_up_next;	  // renege_percent only: next customer giving up at the same tick
+	tick_t *refund_after; // refund_percent only: ticks after getting a seat that the customer cancels, no_tick if they keep it
+	int *refund_next;	  // refund_percent only: next customer cancelling at the same tick
+} customer_table;
+
+// Line and number within the line of a customer, printed as the customer's ID
+#define line_of(c, i) ((i) / (c)->line_stride + 1)
+#define number_of(c, i) ((i) % (c)->line_stride + 1)
+
+// Structure holding staffing state of one seller type
+typedef struct tier_struct
 {
-	char seller_no;
 	char seller_type;
-	queue *seller_queue;
-} sell_arg;
+	int first_slot;	 // Index of the first seller of this type in sellers[]
+	int min_sellers; // Lower bound on active sellers
+	int max_sellers; // Upper bound on active sellers (number of slots)
+	int active;		 // Currently active (not parked) sellers
+	float recent_tat;
+	int tat_sum_seen;			  // tat_sum over all sellers at the previous tick
+	int served_seen;			  // served over all sellers at the previous tick
+	customer_table customers;	  // Every customer of this seller type
+	index_queue arrival_queue;	  // Shared tier queue: customers that have not arrived yet
+	index_queue waiting_queue;	  // Shared tier queue: customers standing in line
+	pthread_mutex_t queue_mutex; // Shared tier queue: guards both queues during a tick
+	int give_up_head[simulation_duration]; // First customer giving up at each tick
+	int refund_head[simulation_duration];  // First customer cancelling at each tick, guarded by reservation_mutex
+	int left_line;						   // Customers who gave up waiting
+	int refunds;						   // Seats returned by cancelling customers
+	int seat_order[seat_count];			   // Seats in the order this seller type fills them
+	int seat_rank[seat_count];			   // Position of each seat in seat_order
+	int seat_cursor;					   // Batched seat commit: seats before it in seat_order are taken
+} cache_aligned tier;
 
-// Structure representing a customer
-typedef struct customer_struct
+// Structure for passing arguments to seller threads
+// Each seller writes only its own structure during a tick, so it gets its own cache lines
+typedef struct sell_arg_struct
 {
-	char cust_no;
-	int arrival_time;
-} customer;
+	int seller_no;
+	char seller_type;
+	tier *seller_tier;
+	index_queue arrival_queue; // Customers that have not arrived yet
+	index_queue waiting_queue; // Customers standing in this seller's line
+	int parked;				   // Set by the staffing controller, guarded by condition_mutex
+	int busy;				   // Serving a customer at the end of the last tick
+	int tat_sum;			   // Sum of TAT of customers served by this seller
+	int served;				   // Number of customers served by this seller
+	int sold;				   // Number of seats assigned by this seller
+	int ticks_on_duty;		   // Clock ticks this seller was not parked
+	int pending_sale;		   // Batched seat commit: customer finished in the last tick, -1 if none
+	pthread_cond_t park_cond;  // Signalled when the controller wakes this seller
+} cache_aligned sell_arg;
 
 // Function prototypes
-void display_queue(queue *q);
-void create_seller_threads(pthread_t *thread, char seller_type, int no_of_sellers);
+void display_queue(customer_table *c, index_queue *q);
+void create_seller_threads(pthread_t *thread, tier *t, int no_of_sellers);
 void wait_for_thread_to_serve_current_time_slice();
 void wakeup_all_seller_threads();
+void process_cancellations();
+void commit_seat_batch();
+int seats_change_at_boundary();
+void sell_seat(sell_arg *seller, int cust, int seatIndex, int sale_tick);
+void adjust_staffing();
+void release_parked_sellers();
 void *sell(void *);
-queue *generate_customer_queue(int);
-int compare_by_arrival_time(void *data1, void *data2);
+void generate_customers(tier *t, int no_of_lines);
+void *alloc_column(int slots, size_t size);
 int findAvailableSeat(char seller_type);
+void init_seat_order(tier *t);
 
 // Global counters
-int thread_count = 0;
-int threads_waiting_for_clock_tick = 0;
-int active_thread = 0;
 int verbose = 0; // Verbosity flag
+int quiet = 0;	 // Skip per-customer event lines, set with -q
+
+// Print a per-customer or staffing controller event unless running quiet
+#define log_event(...)                        \
+	do                                        \
+	{                                         \
+		if (!quiet)                           \
+		{                                     \
+			long log_start = trace_begin();   \
+			printf(__VA_ARGS__);              \
+			trace_end("logging", log_start);  \
+		}                                     \
+	} while (0)
+
+// Staffing state
+sell_arg sellers[total_seller_slots];
+tier tiers[3] = {
+	{'H', 0, hp_seller_min, hp_seller_max},
+	{'M', hp_seller_max, mp_seller_min, mp_seller_max},
+	{'L', hp_seller_max + mp_seller_max, lp_seller_min, lp_seller_max}};
 
 // Function to create seller threads
-void create_seller_threads(pthread_t *thread, char seller_type, int no_of_sellers)
+// The first no_of_sellers sellers get a line of N customers and start active,
+// the remaining slots up to the tier maximum start parked with an empty line
+void create_seller_threads(pthread_t *thread, tier *t, int no_of_sellers)
 {
+	char seller_type = t->seller_type;
+	t->active = no_of_sellers;
+	init_index_queue(&t->arrival_queue);
+	init_index_queue(&t->waiting_queue);
+	pthread_mutex_init(&t->queue_mutex, NULL);
+	init_seat_order(t);
+
 	// Create all threads
-	for (int t_no = 0; t_no < no_of_sellers; t_no++)
+	for (int t_no = 0; t_no < t->max_sellers; t_no++)
 	{
-		// Allocate memory for seller argument structure
-		sell_arg *seller_arg = (sell_arg *)malloc(sizeof(sell_arg));
+		// Initialize seller argument structure
+		sell_arg *seller_arg = &sellers[t->first_slot + t_no];
 		seller_arg->seller_no = t_no;
 		seller_arg->seller_type = seller_type;
-		seller_arg->seller_queue = generate_customer_queue(N);
+		seller_arg->seller_tier = t;
+		init_index_queue(&seller_arg->arrival_queue);
+		init_index_queue(&seller_arg->waiting_queue);
+		seller_arg->parked = t_no >= no_of_sellers;
+		seller_arg->busy = 0;
+		seller_arg->tat_sum = 0;
+		seller_arg->served = 0;
+		seller_arg->sold = 0;
+		seller_arg->ticks_on_duty = 0;
+		seller_arg->pending_sale = -1;
+		pthread_cond_init(&seller_arg->park_cond, NULL);
+	}
+	generate_customers(t, no_of_sellers);
 
+	for (int t_no = 0; t_no < t->max_sellers; t_no++)
+	{
 		// Increment thread count
-		pthread_mutex_lock(&thread_count_mutex);
-		thread_count++;
-		pthread_mutex_unlock(&thread_count_mutex);
+		pthread_mutex_lock(&thread_counts.mutex);
+		thread_counts.thread_count++;
+		pthread_mutex_unlock(&thread_counts.mutex);
 
 		// Print thread creation message if verbose mode is enabled
 		if (verbose)
 			printf("Creating thread %c%02d\n", seller_type, t_no);
 
 		// Create thread
-		pthread_create(thread + t_no, NULL, &sell, seller_arg);
+		pthread_create(thread + t_no, NULL, &sell, &sellers[t->first_slot + t_no]);
 	}
 }
 
-// Function to display contents of a queue
-
 // Function to wait for all threads to serve current time slice
 void wait_for_thread_to_serve_current_time_slice()
 {
 	while (1)
 	{
-		pthread_mutex_lock(&thread_waiting_for_clock_tick_mutex);
-		if (threads_waiting_for_clock_tick == active_thread)
+		pthread_mutex_lock(&tick_barrier.mutex);
+		if (tick_barrier.threads_waiting == thread_counts.active_thread)
 		{
-			threads_waiting_for_clock_tick = 0;
-			pthread_mutex_unlock(&thread_waiting_for_clock_tick_mutex);
+			tick_barrier.threads_waiting = 0;
+			pthread_mutex_unlock(&tick_barrier.mutex);
 			break;
 		}
-		pthread_mutex_unlock(&thread_waiting_for_clock_tick_mutex);
+		pthread_mutex_unlock(&tick_barrier.mutex);
 	}
 }
 
-void display_queue(queue *q)
+// Function to display contents of a queue
+void display_queue(customer_table *c, index_queue *q)
 {
-	for (node *ptr = q->head; ptr != NULL; ptr = ptr->next)
+	for (int i = q->head; i != -1; i = c->next[i])
 	{
-		customer *cust = (customer *)ptr->data;
-		printf("[%d,%d]", cust->cust_no, cust->arrival_time);
+		printf("[%d,%d]", number_of(c, i), c->arrival[i]);
 	}
 }
 
 // Function to wake up all seller threads
+// Staffing is adjusted under the same lock so a seller woken from parking starts with this tick
+// Batched sales and refunds change seats at the tick boundary under one reservation lock
 void wakeup_all_seller_threads()
 {
-	pthread_mutex_lock(&condition_mutex);
+	pthread_mutex_lock(&clock_tick.condition_mutex);
+	int seats_change = seats_change_at_boundary();
+	if (seats_change)
+	{
+		pthread_mutex_lock(&reservation_mutex);
+		reservation_locks++;
+	}
+	long span_start;
+	if (batched_seat_commit && seats_change)
+	{
+		span_start = trace_begin();
+		commit_seat_batch();
+		trace_end("seat commit", span_start);
+	}
+	if (sim_time < simulation_duration && (renege_percent > 0 || refund_percent > 0))
+	{
+		span_start = trace_begin();
+		process_cancellations();
+		trace_end("cancellations", span_start);
+	}
+	if (seats_change)
+		pthread_mutex_unlock(&reservation_mutex);
+
+	if (sim_time < simulation_duration)
+	{
+		if (dynamic_staffing)
+		{
+			span_start = trace_begin();
+			adjust_staffing();
+			trace_end("staffing", span_start);
+		}
+	}
+	else
+		release_parked_sellers();
 	if (verbose)
 		printf("00:%02d Main Thread Broadcasting Clock Tick\n", sim_time);
-	pthread_cond_broadcast(&condition_cond);
-	pthread_mutex_unlock(&condition_mutex);
+	pthread_cond_broadcast(&clock_tick.condition_cond);
+	pthread_mutex_unlock(&clock_tick.condition_mutex);
+}
+
+// Function to check for batched sales or refunds to apply at this tick boundary
+int seats_change_at_boundary()
+{
+	for (int i = 0; batched_seat_commit && i < total_seller_slots; i++)
+	{
+		if (sellers[i].pending_sale != -1)
+			return 1;
+	}
+	for (int i = 0; refund_percent > 0 && sim_time < simulation_duration && i < 3; i++)
+	{
+		if (tiers[i].refund_head[sim_time] != -1)
+			return 1;
+	}
+	return 0;
+}
+
+// Longest service time a seller of the given type can take for one customer
+int max_service_time(char seller_type)
+{
+	switch (seller_type)
+	{
+	case 'H':
+		return 2;
+	case 'M':
+		return 4;
+	default:
+		return 7;
+	}
+}
+
+// Function to draw a random service time based on seller type
+int draw_service_time(char seller_type)
+{
+	switch (seller_type)
+	{
+	case 'H':
+		return (rand() % 2) + 1;
+	case 'M':
+		return (rand() % 3) + 2;
+	default:
+		return (rand() % 4) + 4;
+	}
+}
+
+// Function to count customers waiting in line for the active sellers of a type
+int tier_queue_depth(tier *t)
+{
+	if (shared_tier_queue)
+		return t->waiting_queue.size;
+
+	int depth = 0;
+	for (int i = 0; i < t->max_sellers; i++)
+	{
+		sell_arg *seller = &sellers[t->first_slot + i];
+		if (!seller->parked)
+			depth += seller->waiting_queue.size;
+	}
+	return depth;
+}
+
+// Function to wake up the first parked seller of a type
+void wake_seller(tier *t)
+{
+	for (int i = 0; i < t->max_sellers; i++)
+	{
+		sell_arg *seller = &sellers[t->first_slot + i];
+		if (seller->parked)
+		{
+			seller->parked = 0;
+			t->active++;
+			pthread_mutex_lock(&thread_counts.mutex);
+			thread_counts.active_thread++;
+			pthread_mutex_unlock(&thread_counts.mutex);
+			log_event("00:%02d Controller Woke Up %c%d\n", sim_time, t->seller_type, i + 1);
+			pthread_cond_signal(&seller->park_cond);
+			return;
+		}
+	}
+}
+
+// Function to hand over customers that have not arrived yet from one queue to another, keeping arrival order
+void hand_over_arrivals(customer_table *c, index_queue *from, index_queue *to)
+{
+	index_queue merged;
+	init_index_queue(&merged);
+	while (from->size > 0 || to->size > 0)
+	{
+		index_queue *q = to;
+		if (to->size == 0 || (from->size > 0 && c->arrival[from->head] < c->arrival[to->head]))
+			q = from;
+		index_enqueue(&merged, c->next, c->prev, index_dequeue(q, c->next, c->prev));
+	}
+	*to = merged;
+}
+
+// Function to park the last idle seller of a type
+// Its future customers are handed over to the least loaded active seller
+void park_seller(tier *t)
+{
+	for (int i = t->max_sellers - 1; i >= 0; i--)
+	{
+		sell_arg *seller = &sellers[t->first_slot + i];
+		if (seller->parked || seller->busy || seller->waiting_queue.size > 0)
+			continue;
+
+		sell_arg *target = NULL;
+		for (int j = 0; j < t->max_sellers; j++)
+		{
+			sell_arg *other = &sellers[t->first_slot + j];
+			if (other == seller || other->parked)
+				continue;
+			if (target == NULL || other->arrival_queue.size + other->waiting_queue.size <
+									  target->arrival_queue.size + target->waiting_queue.size)
+				target = other;
+		}
+		hand_over_arrivals(&t->customers, &seller->arrival_queue, &target->arrival_queue);
+
+		seller->parked = 1;
+		t->active--;
+		pthread_mutex_lock(&thread_counts.mutex);
+		thread_counts.active_thread--;
+		pthread_mutex_unlock(&thread_counts.mutex);
+		log_event("00:%02d Controller Parked %c%d\n", sim_time, t->seller_type, i + 1);
+		return;
+	}
+}
+
+// Function to move customers waiting behind a busy seller to idle sellers of the same type
+// With a shared tier queue idle sellers already take the next customer themselves
+void rebalance_tier(tier *t)
+{
+	if (shared_tier_queue)
+		return;
+
+	customer_table *c = &t->customers;
+	for (int i = 0; i < t->max_sellers; i++)
+	{
+		sell_arg *idle = &sellers[t->first_slot + i];
+		if (idle->parked || idle->busy || idle->waiting_queue.size > 0)
+			continue;
+
+		// Take the first customer of the longest line, so it stays first come first served
+		sell_arg *donor = NULL;
+		for (int j = 0; j < t->max_sellers; j++)
+		{
+			sell_arg *other = &sellers[t->first_slot + j];
+			if (other != idle && !other->parked &&
+				(donor == NULL || other->waiting_queue.size > donor->waiting_queue.size))
+				donor = other;
+		}
+		if (donor == NULL || donor->waiting_queue.size == 0 || (!donor->busy && donor->waiting_queue.size < 2))
+			continue;
+
+		int cust = donor->waiting_queue.head;
+		index_remove(&donor->waiting_queue, c->next, c->prev, cust);
+		index_enqueue(&idle->waiting_queue, c->next, c->prev, cust);
+		if (renege_percent > 0)
+			c->waiting_in[cust] = idle - sellers;
+	}
+}
+
+// Function to remove customers who give up waiting from their line and to return cancelled seats for sale
+// Run by the main thread between clock ticks while every seller waits, called with condition_mutex
+// held, and reservation_mutex too when refunds are due. Both use the customer index as a handle,
+// so each event is O(1)
+void process_cancellations()
+{
+	for (int i = 0; i < 3; i++)
+	{
+		tier *t = &tiers[i];
+		customer_table *c = &t->customers;
+
+		for (int cust = t->give_up_head[sim_time]; cust != -1; cust = c->give_up_next[cust])
+		{
+			if (c->start[cust] != no_tick) // Served before running out of patience
+				continue;
+			index_queue *line = c->waiting_in[cust] == -1 ? &t->waiting_queue : &sellers[c->waiting_in[cust]].waiting_queue;
+			index_remove(line, c->next, c->prev, cust);
+			t->left_line++;
+			log_event("00:%02d %c Customer Leaves Line: Customer No %c%d%02d\n", sim_time, t->seller_type, t->seller_type, line_of(c, cust), number_of(c, cust));
+		}
+
+		for (int cust = t->refund_head[sim_time]; cust != -1; cust = c->refund_next[cust])
+		{
+			int row_no = c->seat[cust] / concert_col;
+			int col_no = c->seat[cust] % concert_col;
+			seat_matrix[row_no][col_no] = seat_free;
+			for (int k = 0; k < 3; k++)
+			{
+				if (tiers[k].seat_rank[c->seat[cust]] < tiers[k].seat_cursor)
+					tiers[k].seat_cursor = tiers[k].seat_rank[c->seat[cust]];
+			}
+			c->seat[cust] = no_seat;
+			t->refunds++;
+			log_event("00:%02d %c Refunded Seat %d,%d of Customer No %c%d%02d\n", sim_time, t->seller_type, row_no, col_no, t->seller_type, line_of(c, cust), number_of(c, cust));
+		}
+	}
+}
+
+// Function to seat the customers sellers finished in the last tick
+// Run by the main thread between clock ticks, called with reservation_mutex held
+// Customers of each seller type are seated in arrival order, then by index. Which seller served whom
+// depends on thread timing with a shared tier queue, so the seller is not part of the order
+// Each seller type's seat order is walked once from where the previous batch stopped
+void commit_seat_batch()
+{
+	for (int i = 0; i < 3; i++)
+	{
+		tier *t = &tiers[i];
+		customer_table *c = &t->customers;
+
+		// Insertion sort of the batch, at most one customer per seller
+		sell_arg *batch[total_seller_slots];
+		int batch_size = 0;
+		for (int j = 0; j < t->max_sellers; j++)
+		{
+			sell_arg *seller = &sellers[t->first_slot + j];
+			int cust = seller->pending_sale;
+			if (cust == -1)
+				continue;
+
+			int k = batch_size++;
+			for (; k > 0; k--)
+			{
+				int other = batch[k - 1]->pending_sale;
+				if (c->arrival[other] < c->arrival[cust] || (c->arrival[other] == c->arrival[cust] && other < cust))
+					break;
+				batch[k] = batch[k - 1];
+			}
+			batch[k] = seller;
+		}
+
+		for (int j = 0; j < batch_size; j++)
+		{
+			int row_no = 0, col_no = 0;
+			while (t->seat_cursor < seat_count)
+			{
+				row_no = t->seat_order[t->seat_cursor] / concert_col;
+				col_no = t->seat_order[t->seat_cursor] % concert_col;
+				if (seat_matrix[row_no][col_no] == seat_free)
+					break;
+				t->seat_cursor++;
+			}
+			sell_seat(batch[j], batch[j]->pending_sale, t->seat_cursor < seat_count ? t->seat_order[t->seat_cursor] : -1, sim_time - 1);
+			batch[j]->pending_sale = -1;
+		}
+	}
+}
+
+// Function to give a seat to a customer, or to turn them away when seatIndex is -1
+// Called with reservation_mutex held
+void sell_seat(sell_arg *seller, int cust, int seatIndex, int sale_tick)
+{
+	tier *t = seller->seller_tier;
+	customer_table *c = &t->customers;
+	char seller_type = seller->seller_type;
+	int seller_no = seller->seller_no + 1;
+
+	if (seatIndex == -1)
+	{
+		log_event("00:%02d %c%d Sold Out Tickets: Customer No %c%d%02d .\n", sale_tick, seller_type, seller_no, seller_type, line_of(c, cust), number_of(c, cust));
+		return;
+	}
+
+	int row_no = seatIndex / concert_col;
+	int col_no = seatIndex % concert_col;
+	seat_matrix[row_no][col_no] = seat_owner(t - tiers, cust);
+	log_event("00:%02d %c%d Assigned Seat %d,%d to Customer No %c%d%02d  \n", sale_tick, seller_type, seller_no, row_no, col_no, seller_type, line_of(c, cust), number_of(c, cust));
+	seller->sold++;
+
+	// Schedule the cancellation of customers who will return their seat
+	c->seat[cust] = seatIndex;
+	if (refund_percent > 0 && c->refund_after[cust] != no_tick &&
+		sale_tick + c->refund_after[cust] < simulation_duration)
+	{
+		int refund_tick = sale_tick + c->refund_after[cust];
+		c->refund_next[cust] = t->refund_head[refund_tick];
+		t->refund_head[refund_tick] = cust;
+	}
+}
+
+// Function run by the main thread between clock ticks to scale sellers with demand
+// All active sellers are waiting for the next tick, so their queues can be inspected safely
+// Called with condition_mutex held
+void adjust_staffing()
+{
+	for (int i = 0; i < 3; i++)
+	{
+		tier *t = &tiers[i];
+		if (t->min_sellers == t->max_sellers)
+			continue;
+
+		// Update recent TAT with customers whose service started in the last tick
+		int tat_sum = 0, served = 0;
+		for (int j = 0; j < t->max_sellers; j++)
+		{
+			tat_sum += sellers[t->first_slot + j].tat_sum;
+			served += sellers[t->first_slot + j].served;
+		}
+		if (served > t->served_seen)
+			t->recent_tat = (1 - tat_smoothing) * t->recent_tat +
+							tat_smoothing * (tat_sum - t->tat_sum_seen) / (served - t->served_seen);
+		else
+			t->recent_tat = (1 - tat_smoothing) * t->recent_tat;
+		t->tat_sum_seen = tat_sum;
+		t->served_seen = served;
+
+		int depth = tier_queue_depth(t);
+		float tat_target = tat_target_factor * max_service_time(t->seller_type);
+		if (t->active < t->max_sellers &&
+			(depth >= scale_up_queue_depth * t->active || (depth > 0 && t->recent_tat > tat_target)))
+			wake_seller(t);
+		else if (t->active > t->min_sellers && depth == 0 && t->recent_tat <= tat_target)
+			park_seller(t);
+
+		rebalance_tier(t);
+	}
+}
+
+// Function to wake up parked sellers once the simulation is over so they can exit
+// Called with condition_mutex held
+void release_parked_sellers()
+{
+	for (int i = 0; i < total_seller_slots; i++)
+	{
+		if (sellers[i].parked)
+		{
+			sellers[i].parked = 0;
+			pthread_mutex_lock(&thread_counts.mutex);
+			thread_counts.active_thread++;
+			pthread_mutex_unlock(&thread_counts.mutex);
+			pthread_cond_signal(&sellers[i].park_cond);
+		}
+	}
 }
 
 // Function executed by each seller thread
@@ -136,144 +733,145 @@ void *sell(void *t_args)
 {
 	// Initializing thread
 	sell_arg *args = (sell_arg *)t_args;
-	queue *customer_queue = args->seller_queue;
-	queue *seller_queue = create_queue();
+	customer_table *c = &args->seller_tier->customers;
+	index_queue *customer_queue = shared_tier_queue ? &args->seller_tier->arrival_queue : &args->arrival_queue;
+	index_queue *seller_queue = shared_tier_queue ? &args->seller_tier->waiting_queue : &args->waiting_queue;
 	char seller_type = args->seller_type;
 	int seller_no = args->seller_no + 1;
+	char thread_name[16];
+	snprintf(thread_name, sizeof(thread_name), "%c%d", seller_type, seller_no);
+	trace_thread(args - sellers + 1, thread_name);
 
-	// Update thread count
-	pthread_mutex_lock(&thread_count_mutex);
-	thread_count--;
-	active_thread++;
-	pthread_mutex_unlock(&thread_count_mutex);
+	// Update thread count, parked sellers do not take part in clock ticks
+	pthread_mutex_lock(&thread_counts.mutex);
+	thread_counts.thread_count--;
+	if (!args->parked)
+		thread_counts.active_thread++;
+	pthread_mutex_unlock(&thread_counts.mutex);
 
-	customer *cust = NULL;
+	int cust = -1;
 	int random_wait_time = 0;
-	int temp1 = 0;
 
 	// Main loop for selling tickets
 	while (sim_time < simulation_duration)
 	{
 		// Waiting for clock tick
-		pthread_mutex_lock(&condition_mutex);
+		long span_start = trace_begin();
+		pthread_mutex_lock(&clock_tick.condition_mutex);
 		if (verbose)
 			printf("00:%02d %c%02d Waiting for next clock tick\n", sim_time, seller_type, seller_no);
 
-		pthread_mutex_lock(&thread_waiting_for_clock_tick_mutex);
-		threads_waiting_for_clock_tick++;
-		pthread_mutex_unlock(&thread_waiting_for_clock_tick_mutex);
+		if (!args->parked)
+		{
+			pthread_mutex_lock(&tick_barrier.mutex);
+			tick_barrier.threads_waiting++;
+			pthread_mutex_unlock(&tick_barrier.mutex);
+
+			pthread_cond_wait(&clock_tick.condition_cond, &clock_tick.condition_mutex);
+		}
 
-		pthread_cond_wait(&condition_cond, &condition_mutex);
+		// Parked by the staffing controller, sleep until woken up again
+		while (args->parked && sim_time < simulation_duration)
+			pthread_cond_wait(&args->park_cond, &clock_tick.condition_mutex);
 		if (verbose)
 			printf("00:%02d %c%02d Received Clock Tick\n", sim_time, seller_type, seller_no);
-		pthread_mutex_unlock(&condition_mutex);
+		pthread_mutex_unlock(&clock_tick.condition_mutex);
+		trace_end("tick wait", span_start);
 
 		// Sell tickets
 		if (sim_time == simulation_duration)
 			break;
+		args->ticks_on_duty++;
 
 		// Handle arrival of new customers
-		while (customer_queue->size > 0 && ((customer *)customer_queue->head->data)->arrival_time <= sim_time)
+		// The first seller of a tier to get here moves the arrivals into the shared line
+		int next = -1;
+		span_start = trace_begin();
+		if (shared_tier_queue)
+			pthread_mutex_lock(&args->seller_tier->queue_mutex);
+		while (customer_queue->size > 0 && c->arrival[customer_queue->head] <= sim_time)
 		{
-			customer *temp = (customer *)dequeue(customer_queue);
-			enqueue(seller_queue, temp);
-			printf("00:%02d %c%d Arrived: Customer No %c%d%02d\n", sim_time, seller_type, seller_no, seller_type, seller_no, temp->cust_no);
+			int temp = index_dequeue(customer_queue, c->next, c->prev);
+			index_enqueue(seller_queue, c->next, c->prev, temp);
+			if (renege_percent > 0)
+				c->waiting_in[temp] = shared_tier_queue ? -1 : args - sellers;
+			log_event("00:%02d %c%d Arrived: Customer No %c%d%02d\n", sim_time, seller_type, seller_no, seller_type, line_of(c, temp), number_of(c, temp));
 		}
+		if (cust == -1 && seller_queue->size > 0)
+			next = index_dequeue(seller_queue, c->next, c->prev);
+		if (shared_tier_queue)
+			pthread_mutex_unlock(&args->seller_tier->queue_mutex);
+		trace_end("arrival intake", span_start);
 
 		// Serve next customer
-		if (cust == NULL && seller_queue->size > 0)
+		if (next != -1)
 		{
-			cust = (customer *)dequeue(seller_queue);
-			printf("00:%02d %c%d Serving: Customer No %c%d%02d\n", sim_time, seller_type, seller_no, seller_type, seller_no, cust->cust_no);
+			cust = next;
+			log_event("00:%02d %c%d Serving: Customer No %c%d%02d\n", sim_time, seller_type, seller_no, seller_type, line_of(c, cust), number_of(c, cust));
 
-			// Determine random wait time based on seller type
-			switch (seller_type)
-			{
-			case 'H':
-				random_wait_time = (rand() % 2) + 1;
-				bt1[temp1] = random_wait_time;
-				temp1++;
-				break;
-			case 'M':
-				random_wait_time = (rand() % 3) + 2;
-				bt1[temp1] = random_wait_time;
-				temp1++;
-				break;
-			case 'L':
-				random_wait_time = (rand() % 4) + 4;
-				bt1[temp1] = random_wait_time;
-				temp1++;
-			}
-			if (seller_type == 'H')
-			{
-				rt_H[cust->cust_no] = sim_time - cust->arrival_time;					 // Response time calculation
-				tat_H[cust->cust_no] = sim_time + random_wait_time - cust->arrival_time; // TAT calculation
-			}
-			else if (seller_type == 'M')
-			{
-				rt_M[cust->cust_no] = sim_time - cust->arrival_time;
-				tat_M[cust->cust_no] = sim_time + random_wait_time - cust->arrival_time;
-			}
-			else if (seller_type == 'L')
-			{
-				rt_L[cust->cust_no] = sim_time - cust->arrival_time;
-				tat_L[cust->cust_no] = sim_time + random_wait_time - cust->arrival_time;
-			}
+			// Service time was drawn when the customer was generated
+			random_wait_time = c->service[cust];
+			c->start[cust] = sim_time;
+			args->tat_sum += sim_time + random_wait_time - c->arrival[cust];
+			args->served++;
 		}
 
 		// Process customer if exists
-		if (cust != NULL)
+		if (cust != -1)
 		{
 			if (random_wait_time == 0)
 			{
-				// Selling seat
-				pthread_mutex_lock(&reservation_mutex);
-
-				// Find available seat
-				int seatIndex = findAvailableSeat(seller_type);
-				if (seatIndex == -1)
+				if (batched_seat_commit)
 				{
-					printf("00:%02d %c%d Sold Out Tickets: Customer No %c%d%02d .\n", sim_time, seller_type, seller_no, seller_type, seller_no, cust->cust_no);
+					// Seated by the main thread at the next tick boundary
+					args->pending_sale = cust;
 				}
 				else
 				{
-					int row_no = seatIndex / concert_col;
-					int col_no = seatIndex % concert_col;
-					sprintf(seat_matrix[row_no][col_no], "%c%d%02d", seller_type, seller_no, cust->cust_no);
-					printf("00:%02d %c%d Assigned Seat %d,%d to Customer No %c%d%02d  \n", sim_time, seller_type, seller_no, row_no, col_no, seller_type, seller_no, cust->cust_no);
-					cust_served++;
-
-					// Update throughput based on seller type
-					if (seller_type == 'L')
-						throughput[0]++;
-					else if (seller_type == 'M')
-						throughput[1]++;
-					else if (seller_type == 'H')
-						throughput[2]++;
+					// Selling seat
+					span_start = trace_begin();
+					pthread_mutex_lock(&reservation_mutex);
+					trace_end("lock wait", span_start);
+					long hold_start = trace_begin();
+					reservation_locks++;
+
+					// Find available seat
+					span_start = trace_begin();
+					int seatIndex = findAvailableSeat(seller_type);
+					trace_end("seat search", span_start);
+					sell_seat(args, cust, seatIndex, sim_time);
+					pthread_mutex_unlock(&reservation_mutex);
+					trace_end("lock hold", hold_start);
 				}
-				pthread_mutex_unlock(&reservation_mutex);
-				cust = NULL;
+				c->finish[cust] = sim_time;
+				cust = -1;
 			}
 			else
 			{
 				random_wait_time--;
 			}
 		}
+		args->busy = cust != -1;
 	}
 
 	// Process remaining customers
-	while (cust != NULL || seller_queue->size > 0)
+	if (shared_tier_queue)
+		pthread_mutex_lock(&args->seller_tier->queue_mutex);
+	while (cust != -1 || seller_queue->size > 0)
 	{
-		if (cust == NULL)
-			cust = (customer *)dequeue(seller_queue);
-		printf("00:%02d %c%d Ticket Sale Closed. Customer Leaves:  %c%d%02d \n", sim_time, seller_type, seller_no, seller_type, seller_no, cust->cust_no);
-		cust = NULL;
+		if (cust == -1)
+			cust = index_dequeue(seller_queue, c->next, c->prev);
+		log_event("00:%02d %c%d Ticket Sale Closed. Customer Leaves:  %c%d%02d \n", sim_time, seller_type, seller_no, seller_type, line_of(c, cust), number_of(c, cust));
+		cust = -1;
 	}
+	if (shared_tier_queue)
+		pthread_mutex_unlock(&args->seller_tier->queue_mutex);
 
 	// Update active thread count
-	pthread_mutex_lock(&thread_count_mutex);
-	active_thread--;
-	pthread_mutex_unlock(&thread_count_mutex);
+	pthread_mutex_lock(&thread_counts.mutex);
+	thread_counts.active_thread--;
+	pthread_mutex_unlock(&thread_counts.mutex);
+	return NULL;
 }
 
 // Function to find available seat based on seller type
@@ -288,7 +886,7 @@ int findAvailableSeat(char seller_type)
 		{
 			for (int col_no = 0; col_no < concert_col; col_no++)
 			{
-				if (strcmp(seat_matrix[row_no][col_no], "-") == 0)
+				if (seat_matrix[row_no][col_no] == seat_free)
 				{
 					seatIndex = row_no * concert_col + col_no;
 					return seatIndex;
@@ -309,7 +907,7 @@ int findAvailableSeat(char seller_type)
 			{
 				for (int col_no = 0; col_no < concert_col; col_no++)
 				{
-					if (strcmp(seat_matrix[row_no][col_no], "-") == 0)
+					if (seat_matrix[row_no][col_no] == seat_free)
 					{
 						seatIndex = row_no * concert_col + col_no;
 						return seatIndex;
@@ -321,7 +919,7 @@ int findAvailableSeat(char seller_type)
 			{
 				for (int col_no = 0; col_no < concert_col; col_no++)
 				{
-					if (strcmp(seat_matrix[row_no][col_no], "-") == 0)
+					if (seat_matrix[row_no][col_no] == seat_free)
 					{
 						seatIndex = row_no * concert_col + col_no;
 						return seatIndex;
@@ -341,7 +939,7 @@ int findAvailableSeat(char seller_type)
 		{
 			for (int col_no = concert_col - 1; col_no >= 0; col_no--)
 			{
-				if (strcmp(seat_matrix[row_no][col_no], "-") == 0)
+				if (seat_matrix[row_no][col_no] == seat_free)
 				{
 					seatIndex = row_no * concert_col + col_no;
 					return seatIndex;
@@ -353,110 +951,236 @@ int findAvailableSeat(char seller_type)
 	return -1;
 }
 
-// Function to generate customer queue with random arrival times
-queue *generate_customer_queue(int N)
+// Function to fill the order in which a seller type takes seats, matching findAvailableSeat
+void init_seat_order(tier *t)
 {
-	queue *customer_queue = create_queue();
-	char cust_no = 0;
-	while (N--)
-	{
-		customer *cust = (customer *)malloc(sizeof(customer));
-		cust->cust_no = cust_no;
-		cust->arrival_time = rand() % simulation_duration;
-		at1[cust_no] = cust->arrival_time;
-		enqueue(customer_queue, cust);
-		cust_no++;
-	}
-	sort(customer_queue, compare_by_arrival_time);
-	node *ptr = customer_queue->head;
-	cust_no = 0;
-	while (ptr != NULL)
-	{
-		cust_no++;
-		customer *cust = (customer *)ptr->data;
-		cust->cust_no = cust_no;
-		ptr = ptr->next;
-	}
-	return customer_queue;
+	int rows[concert_row];
+	int n = 0;
+	if (t->seller_type == 'M')
+	{
+		// Middle row first, then one row forward and one row back
+		int mid = (concert_row / 2) - 1;
+		for (int row_jump = 0; n < concert_row; row_jump++)
+		{
+			if (mid + row_jump < concert_row)
+				rows[n++] = mid + row_jump;
+			if (row_jump > 0 && mid - row_jump >= 0)
+				rows[n++] = mid - row_jump;
+		}
+	}
+	else
+	{
+		for (int i = 0; i < concert_row; i++)
+			rows[i] = t->seller_type == 'L' ? concert_row - 1 - i : i;
+	}
+
+	n = 0;
+	for (int i = 0; i < concert_row; i++)
+	{
+		for (int j = 0; j < concert_col; j++)
+		{
+			int seatIndex = rows[i] * concert_col + (t->seller_type == 'L' ? concert_col - 1 - j : j);
+			t->seat_order[n] = seatIndex;
+			t->seat_rank[seatIndex] = n;
+			n++;
+		}
+	}
+	t->seat_cursor = 0;
 }
 
-// Function to compare customers by arrival time
-int compare_by_arrival_time(void *data1, void *data2)
+// Function to allocate a customer table column starting on a cache line boundary
+void *alloc_column(int slots, size_t size)
 {
-	customer *c1 = (customer *)data1;
-	customer *c2 = (customer *)data2;
-	if (c1->arrival_time < c2->arrival_time)
+	void *column = NULL;
+	if (posix_memalign(&column, cache_line_size, (size_t)slots * size) != 0)
 	{
-		return -1;
+		fprintf(stderr, "Out of memory for %d customers\n", slots);
+		exit(1);
 	}
-	else if (c1->arrival_time == c2->arrival_time)
+	return column;
+}
+
+// Function to generate N customers with random arrival times for each of the first no_of_lines sellers
+// Each line is numbered by arrival time and queued on its seller, or merged into the shared tier queue
+void generate_customers(tier *t, int no_of_lines)
+{
+	customer_table *c = &t->customers;
+	long stride = cache_line_layout ? ((long)N + cache_line_size - 1) / cache_line_size * cache_line_size : N;
+	if (no_of_lines * stride > max_customers_per_tier)
 	{
-		return 0;
+		fprintf(stderr, "Too many customers for seller %c, at most %d per type\n", t->seller_type, max_customers_per_tier);
+		exit(1);
 	}
-	else
+
+	// Preallocate every column, the cancellation columns only when that workload is enabled
+	// Padding entries are never queued and keep no_tick, so they are skipped by the statistics
+	int slots = no_of_lines * stride;
+	c->count = no_of_lines * N;
+	c->slots = slots;
+	c->line_size = N;
+	c->line_stride = (int)stride;
+	c->arrival = (tick_t *)alloc_column(slots, sizeof(tick_t));
+	c->service = (tick_t *)alloc_column(slots, sizeof(tick_t));
+	c->start = (tick_t *)alloc_column(slots, sizeof(tick_t));
+	c->finish = (tick_t *)alloc_column(slots, sizeof(tick_t));
+	c->seat = (seat_t *)alloc_column(slots, sizeof(seat_t));
+	c->next = (int *)alloc_column(slots, sizeof(int));
+	c->prev = (int *)alloc_column(slots, sizeof(int));
+	memset(c->start, no_tick, slots * sizeof(tick_t));
+	memset(c->finish, no_tick, slots * sizeof(tick_t));
+	memset(c->seat, no_seat, slots * sizeof(seat_t));
+	c->slot_bytes = 4 * sizeof(tick_t) + sizeof(seat_t) + 2 * sizeof(int);
+	if (renege_percent > 0)
 	{
-		return 1;
+		c->waiting_in = (short *)alloc_column(slots, sizeof(short));
+		c->give_up_next = (int *)alloc_column(slots, sizeof(int));
+		c->slot_bytes += sizeof(short) + sizeof(int);
+	}
+	if (refund_percent > 0)
+	{
+		c->refund_after = (tick_t *)alloc_column(slots, sizeof(tick_t));
+		c->refund_next = (int *)alloc_column(slots, sizeof(int));
+		c->slot_bytes += sizeof(tick_t) + sizeof(int);
+	}
+	for (int tick = 0; tick < simulation_duration; tick++)
+	{
+		t->give_up_head[tick] = -1;
+		t->refund_head[tick] = -1;
+	}
+
+	for (int line = 0; line < no_of_lines; line++)
+	{
+		// Counting sort of the line's arrival times
+		int first = line * stride;
+		int arrivals_at[simulation_duration] = {0};
+		for (int i = 0; i < N; i++)
+			arrivals_at[rand() % simulation_duration]++;
+		for (int tick = 0, i = first; tick < simulation_duration; tick++)
+			while (arrivals_at[tick]--)
+				c->arrival[i++] = tick;
+
+		for (int i = first; i < first + N; i++)
+		{
+			c->service[i] = draw_service_time(t->seller_type);
+
+			// Random draws only happen when enabled so the default workload is unchanged
+			if (renege_percent > 0 && rand() % 100 < renege_percent)
+			{
+				int give_up = c->arrival[i] + 1 + rand() % max_patience;
+				if (give_up < simulation_duration)
+				{
+					c->give_up_next[i] = t->give_up_head[give_up];
+					t->give_up_head[give_up] = i;
+				}
+			}
+			if (refund_percent > 0)
+				c->refund_after[i] = rand() % 100 < refund_percent ? 1 + rand() % max_refund_delay : no_tick;
+			if (!shared_tier_queue)
+				index_enqueue(&sellers[t->first_slot + line].arrival_queue, c->next, c->prev, i);
+		}
+	}
+
+	// Merge the sorted lines of the tier into one queue, tick by tick
+	if (shared_tier_queue)
+	{
+		int *cursor = (int *)malloc(no_of_lines * sizeof(int));
+		for (int line = 0; line < no_of_lines; line++)
+			cursor[line] = line * stride;
+		for (int tick = 0; tick < simulation_duration; tick++)
+		{
+			for (int line = 0; line < no_of_lines; line++)
+			{
+				while (cursor[line] < line * stride + N && c->arrival[cursor[line]] == tick)
+					index_enqueue(&t->arrival_queue, c->next, c->prev, cursor[line]++);
+			}
+		}
+		free(cursor);
+	}
+}
+
+// Function to find the response time within which the given percent of customers were served
+int rt_percentile(int *rt_hist, int served, int percent)
+{
+	int seen = 0;
+	for (int rt = 0; rt < simulation_duration; rt++)
+	{
+		seen += rt_hist[rt];
+		if (seen > 0 && seen * 100 >= served * percent)
+			return rt;
 	}
+	return 0;
 }
 
 // Main function
 int main(int argc, char **argv)
 {
 	srand(4388); // Seed random number generator
+	trace_init(total_seller_slots + 1); // Main thread and one buffer per seller slot
+	trace_thread(0, "main");
 
-	// Check if N is provided as command-line argument
-	if (argc == 2)
+	// Check if N is provided as command-line argument, -q after it skips the per-customer events
+	if (argc >= 2)
 	{
 		N = atoi(argv[1]); // Set number of customers
 	}
+	if (N < 0)
+	{
+		fprintf(stderr, "Number of customers must not be negative\n");
+		return 1;
+	}
+	if (argc >= 3 && strcmp(argv[2], "-q") == 0)
+		quiet = 1;
 
 	// Initialize seat matrix
 	for (int r = 0; r < concert_row; r++)
 	{
 		for (int c = 0; c < concert_col; c++)
 		{
-			strncpy(seat_matrix[r][c], "-", 1); // Set all seats as available
+			seat_matrix[r][c] = seat_free; // Set all seats as available
 		}
 	}
 
 	// Create seller threads for each type
-	create_seller_threads(seller_t, 'H', hp_seller_count);
-	create_seller_threads(seller_t + hp_seller_count, 'M', mp_seller_count);
-	create_seller_threads(seller_t + hp_seller_count + mp_seller_count, 'L', lp_seller_count);
+	create_seller_threads(seller_t + tiers[0].first_slot, &tiers[0], hp_seller_count);
+	create_seller_threads(seller_t + tiers[1].first_slot, &tiers[1], mp_seller_count);
+	create_seller_threads(seller_t + tiers[2].first_slot, &tiers[2], lp_seller_count);
 
 	// Wait for threads to finish initialization and synchronize with clock tick
 	while (1)
 	{
-		pthread_mutex_lock(&thread_count_mutex);
-		if (thread_count == 0) //all seller thraeds are correctly initialized
+		pthread_mutex_lock(&thread_counts.mutex);
+		if (thread_counts.thread_count == 0) //all seller thraeds are correctly initialized
 		{
-			pthread_mutex_unlock(&thread_count_mutex);
+			pthread_mutex_unlock(&thread_counts.mutex);
 			break;
 		}
-		pthread_mutex_unlock(&thread_count_mutex);
+		pthread_mutex_unlock(&thread_counts.mutex);
 	}
 
 	// Simulate each time slice
 	printf("===============================\n");
 	printf("Starting Simulation Threads\n");
 	printf("===============================\n");
-	threads_waiting_for_clock_tick = 0; //before simulation there is no thraed waiting
-	wakeup_all_seller_threads(); // For first tick
+	struct timespec sim_start, sim_end;
+	clock_gettime(CLOCK_MONOTONIC, &sim_start);
+	wait_for_thread_to_serve_current_time_slice(); // Every active seller is waiting before the first tick
+	wakeup_all_seller_threads();					// For first tick
 
 	do
 	{
 		// Wake up all threads
+		long span_start = trace_begin();
 		wait_for_thread_to_serve_current_time_slice();
+		trace_end("tick barrier", span_start);
 		sim_time = sim_time + 1;
 		wakeup_all_seller_threads();
 	} while (sim_time < simulation_duration);
-
-	// Wake up all threads to prevent deadlock
-	wakeup_all_seller_threads();
+	// The last wakeup above let every seller see the end of the sale and released parked sellers
 
 	// Wait for all threads to complete
-	while (active_thread)
-		;
+	for (int i = 0; i < total_seller_slots; i++)
+		pthread_join(seller_t[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &sim_end);
 
 	// Display final concert seat chart and statistics
 	printf("\n\n");
@@ -470,15 +1194,22 @@ int main(int argc, char **argv)
 	{
 		for (int c = 0; c < concert_col; c++)
 		{
+			char owner[24] = "-"; // Type letter, then line and number as ints, never truncated
+			if (seat_matrix[r][c] != seat_free)
+			{
+				tier *t = &tiers[seat_tier(seat_matrix[r][c])];
+				int cust = seat_customer(seat_matrix[r][c]);
+				snprintf(owner, sizeof(owner), "%c%d%02d", t->seller_type, line_of(&t->customers, cust), number_of(&t->customers, cust));
+				if (t->seller_type == 'H')
+					h_customers++;
+				if (t->seller_type == 'M')
+					m_customers++;
+				if (t->seller_type == 'L')
+					l_customers++;
+			}
 			if (c != 0)
 				printf("\t");
-			printf("%5s", seat_matrix[r][c]);
-			if (seat_matrix[r][c][0] == 'H')
-				h_customers++;
-			if (seat_matrix[r][c][0] == 'M')
-				m_customers++;
-			if (seat_matrix[r][c][0] == 'L')
-				l_customers++;
+			printf("%5s", owner);
 		}
 		printf("\n");
 	}
@@ -495,54 +1226,105 @@ int main(int argc, char **argv)
 	printf("|%3c | %15d | %8d | %8d |\n", 'L', lp_seller_count * N, l_customers, (lp_seller_count * N) - l_customers);
 	printf(" ============================================\n");
 
-	// Calculate and display average metrics
-	for (int z1 = 0; z1 < N; z1++)
+	// Calculate response time, turnaround time and throughput per seller type from the customer tables
+	double avg_rt[3] = {0}, avg_tat[3] = {0}, throughput[3] = {0};
+	int started[3] = {0}, finished[3] = {0}, tier_ticks[3] = {0};
+	int rt_hist[3][simulation_duration] = {{0}};
+	double avg_rt_all = 0, avg_tat_all = 0;
+	int started_all = 0, finished_all = 0;
+	for (int i = 0; i < 3; i++)
 	{
-		int ct = 0;
-		ct = st1[z1] + bt1[z1];
-		rt1[z1] = abs(st1[z1] - at1[z1]);
-		tat1[z1] = abs(ct - at1[z1]);
+		customer_table *c = &tiers[i].customers;
+		for (int j = 0; j < c->slots; j++)
+		{
+			if (c->start[j] != no_tick)
+			{
+				avg_rt[i] += c->start[j] - c->arrival[j];
+				rt_hist[i][c->start[j] - c->arrival[j]]++;
+				started[i]++;
+			}
+			if (c->finish[j] != no_tick)
+			{
+				avg_tat[i] += c->finish[j] - c->arrival[j];
+				finished[i]++;
+			}
+		}
+		for (int j = 0; j < tiers[i].max_sellers; j++)
+		{
+			throughput[i] += sellers[tiers[i].first_slot + j].sold;
+			tier_ticks[i] += sellers[tiers[i].first_slot + j].ticks_on_duty;
+		}
+		avg_rt_all += avg_rt[i];
+		avg_tat_all += avg_tat[i];
+		started_all += started[i];
+		finished_all += finished[i];
+		avg_rt[i] = started[i] ? avg_rt[i] / started[i] : 0;
+		avg_tat[i] = finished[i] ? avg_tat[i] / finished[i] : 0;
 	}
 
-	for (int j1 = 0; j1 < N; j1++)
+	printf("\n\n============================================\n");
+	printf("Average RT is %.2f\n", started_all ? avg_rt_all / started_all : 0);
+	printf("Average TAT is %.2f\n", finished_all ? avg_tat_all / finished_all : 0);
+	printf("Average Response Time H: %.2f\n", avg_rt[0]);
+	printf("Average Turn-Around Time H: %.2f\n", avg_tat[0]);
+	printf("Average Response Time M: %.2f\n", avg_rt[1]);
+	printf("Average Turn-Around Time M: %.2f\n", avg_tat[1]);
+	printf("Average Response Time L: %.2f\n", avg_rt[2]);
+	printf("Average Turn-Around Time L: %.2f\n", avg_tat[2]);
+	printf("Throughput of seller H is %.2f\n", throughput[0] / 60.0);
+	printf("Throughput of seller M is %.2f\n", throughput[1] / 60.0);
+	printf("Throughput of seller L is %.2f\n", throughput[2] / 60.0);
+	printf("============================================\n");
+
+	// Staffing cost against keeping the initial sellers on duty for the whole sale
+	// and response time distribution of everyone who was served
+	int seller_ticks = 0;
+	printf("\n\n============================================\n");
+	printf("%s\n", shared_tier_queue ? "Shared customer queue per seller type" : "Private customer queue per seller");
+	for (int i = 0; i < 3; i++)
 	{
-		avg_tat += tat1[j1];
-		avg_rt += rt1[j1];
+		seller_ticks += tier_ticks[i];
+		printf("Seller %c: %d seller-ticks, Average TAT of %d served: %.2f\n", tiers[i].seller_type, tier_ticks[i], finished[i], avg_tat[i]);
+		printf("Seller %c: Average RT %.2f, p95 RT %d, Max RT %d\n", tiers[i].seller_type,
+			   avg_rt[i], rt_percentile(rt_hist[i], started[i], 95), rt_percentile(rt_hist[i], started[i], 100));
 	}
+	printf("Seller-ticks consumed: %d (static staffing: %d)\n", seller_ticks, total_seller * simulation_duration);
 
-	float avg_rt_H = 0, avg_tat_H = 0;
-	float avg_rt_M = 0, avg_tat_M = 0;
-	float avg_rt_L = 0, avg_tat_L = 0;
-	for (int i = 0; i < N; i++)
+	// Mixed buy/cancel workload
+	int sales = 0, refunds = 0, left_line = 0;
+	for (int i = 0; i < 3; i++)
 	{
-		avg_rt_H += rt_H[i];
-		avg_tat_H += tat_H[i];
-		avg_rt_M += rt_M[i];
-		avg_tat_M += tat_M[i];
-		avg_rt_L += rt_L[i];
-		avg_tat_L += tat_L[i];
+		sales += throughput[i];
+		refunds += tiers[i].refunds;
+		left_line += tiers[i].left_line;
+		printf("Seller %c: %d customers left the line, %d seats refunded\n", tiers[i].seller_type, tiers[i].left_line, tiers[i].refunds);
 	}
+	printf("%d sales and %d refunds in %d ticks (%.2f ticket operations per tick)\n", sales, refunds, simulation_duration,
+		   (float)(sales + refunds) / simulation_duration);
 
-	// Calculate averages
-	avg_rt_H /= N;
-	avg_tat_H /= N;
-	avg_rt_M /= N;
-	avg_tat_M /= N;
-	avg_rt_L /= N;
-	avg_tat_L /= N;
+	// Wall clock speed of the tick loop, see README for measuring cache misses
+	double elapsed = (sim_end.tv_sec - sim_start.tv_sec) + (sim_end.tv_nsec - sim_start.tv_nsec) / 1e9;
+	printf("%d sellers simulated %d ticks in %.2f ms (%.0f ticks per second)\n", total_seller_slots, simulation_duration,
+		   elapsed * 1000, simulation_duration / elapsed);
+	printf("%s: reservation lock taken %ld times\n", batched_seat_commit ? "Batched seat commit" : "Seat sold under its own lock",
+		   reservation_locks);
 
-	printf("\n\n============================================\n");
-	printf("Average RT is %.2f\n", avg_rt / N);
-	printf("Average TAT is %.2f\n", avg_tat / N);
-	printf("Average Response Time H: %.2f\n", avg_rt_H);
-	printf("Average Turn-Around Time H: %.2f\n", avg_tat_H);
-	printf("Average Response Time M: %.2f\n", avg_rt_M);
-	printf("Average Turn-Around Time M: %.2f\n", avg_tat_M);
-	printf("Average Response Time L: %.2f\n", avg_rt_L);
-	printf("Average Turn-Around Time L: %.2f\n", avg_tat_L);
-	printf("Throughput of seller H is %.2f\n", throughput[0] / 60.0);
-	printf("Throughput of seller M is %.2f\n", throughput[1] / 60.0);
-	printf("Throughput of seller L is %.2f\n", throughput[2] / 60.0);
+	// Memory footprint of the customer tables against the budget, and of the whole process
+	long customers = 0, table_bytes = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		customers += tiers[i].customers.count;
+		table_bytes += (long)tiers[i].customers.slots * tiers[i].customers.slot_bytes;
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	long spans = trace_write();
+	if (spans >= 0)
+		printf("%ld trace spans written to %s\n", spans, getenv("TRACE_FILE"));
+	double customer_bytes = customers ? (double)table_bytes / customers : 0;
+	printf("%ld customers in %ld KB of customer tables (%.1f bytes per customer, %s the budget of %d, %d per column slot), peak RSS %ld KB\n",
+		   customers, table_bytes / 1024, customer_bytes, customer_bytes > customer_bytes_budget ? "over" : "within",
+		   customer_bytes_budget, tiers[0].customers.slot_bytes, usage.ru_maxrss);
 	printf("============================================\n");
 	return 0;
 }
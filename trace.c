@@ -0,0 +1,112 @@
+#define _POSIX_C_SOURCE 200112L // For clock_gettime with -std=c99
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+
+#define trace_buffer_events 65536 // Per thread, must be a power of two
+
+__thread trace_buffer *trace_current = NULL;
+
+static trace_buffer *buffers = NULL;
+static int buffer_count = 0;
+static const char *trace_file = NULL;
+static struct timespec trace_epoch;
+
+// Function to allocate one ring buffer per thread if TRACE_FILE is set
+void trace_init(int threads)
+{
+	trace_file = getenv("TRACE_FILE");
+	if (trace_file == NULL || trace_file[0] == '\0')
+		return;
+
+	void *memory = NULL;
+	if (posix_memalign(&memory, trace_cache_line, threads * sizeof(trace_buffer)) != 0)
+	{
+		perror("trace buffers");
+		return;
+	}
+	buffers = (trace_buffer *)memory;
+	memset(buffers, 0, threads * sizeof(trace_buffer));
+	for (int i = 0; i < threads; i++)
+	{
+		buffers[i].events = (trace_event *)malloc(trace_buffer_events * sizeof(trace_event));
+		if (buffers[i].events == NULL)
+		{
+			// Leave tracing disabled rather than record into a missing ring
+			perror("trace buffers");
+			for (int j = 0; j < i; j++)
+				free(buffers[j].events);
+			free(buffers);
+			buffers = NULL;
+			return;
+		}
+	}
+	buffer_count = threads;
+	clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+}
+
+// Function to make the calling thread record into buffer tid
+void trace_thread(int tid, const char *name)
+{
+	if (buffers == NULL)
+		return;
+
+	trace_current = &buffers[tid];
+	strncpy(trace_current->name, name, sizeof(trace_current->name) - 1);
+}
+
+// Function to read the trace clock
+long trace_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - trace_epoch.tv_sec) * 1000000000L + (now.tv_nsec - trace_epoch.tv_nsec);
+}
+
+// Function to record a finished span, overwriting the oldest one when the ring is full
+void trace_record(const char *name, long start)
+{
+	trace_event *e = &trace_current->events[trace_current->count++ & (trace_buffer_events - 1)];
+	e->name = name;
+	e->start = start;
+	e->duration = trace_now() - start;
+}
+
+// Function to write every buffer to TRACE_FILE, returns the number of spans written or -1
+// Called once all traced threads have finished
+long trace_write()
+{
+	if (buffers == NULL)
+		return -1;
+
+	FILE *f = fopen(trace_file, "w");
+	if (f == NULL)
+	{
+		perror(trace_file);
+		return -1;
+	}
+
+	long written = 0;
+	fprintf(f, "{\"traceEvents\":[\n");
+	for (int tid = 0; tid < buffer_count; tid++)
+	{
+		trace_buffer *b = &buffers[tid];
+		if (b->count == 0)
+			continue;
+
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				written ? ",\n" : "", tid, b->name);
+		for (long i = b->count > trace_buffer_events ? b->count - trace_buffer_events : 0; i < b->count; i++)
+		{
+			trace_event *e = &b->events[i & (trace_buffer_events - 1)];
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+					e->name, tid, e->start / 1000.0, e->duration / 1000.0);
+			written++;
+		}
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	return written;
+}
@@ -0,0 +1,53 @@
+#ifndef _trace_h_
+#define _trace_h_
+
+// Timeline Tracing //
+
+// Spans are recorded by each thread into its own ring buffer and written out as
+// Chrome trace-event JSON, which chrome://tracing and ui.perfetto.dev can open
+// Tracing is enabled at run time by setting TRACE_FILE, otherwise spans are not recorded
+
+struct trace_event_s
+{
+	const char *name;
+	long start;	   // Nanoseconds since trace_init
+	long duration; // Nanoseconds
+};
+
+typedef struct trace_event_s trace_event;
+
+// Each buffer takes a whole cache line so threads recording spans never write to the same line
+#define trace_cache_line 64
+
+struct trace_buffer_s
+{
+	char name[16];
+	long count; // Events recorded, the ring keeps the most recent ones
+	trace_event *events;
+} __attribute__((aligned(trace_cache_line)));
+
+typedef struct trace_buffer_s trace_buffer;
+
+// Ring buffer of the calling thread, NULL while tracing is disabled
+extern __thread trace_buffer *trace_current;
+
+void trace_init(int threads);
+void trace_thread(int tid, const char *name);
+long trace_now();
+void trace_record(const char *name, long start);
+long trace_write();
+
+// Function to start a span, returns the start time to pass to trace_end
+static inline long trace_begin()
+{
+	return trace_current ? trace_now() : 0;
+}
+
+// Function to end a span started with trace_begin
+static inline void trace_end(const char *name, long start)
+{
+	if (trace_current)
+		trace_record(name, start);
+}
+
+#endif
@@ -219,3 +219,53 @@ void *dequeue(queue *q)
 		return data;
 	}
 }
+
+// Index Queue Implementation //
+
+// Initialize an empty index queue //
+void init_index_queue(index_queue *q)
+{
+	q->head = -1;
+	q->tail = -1;
+	q->size = 0;
+}
+
+// Enqueue function to add index i at the end of the queue //
+void index_enqueue(index_queue *q, int *next, int *prev, int i)
+{
+	next[i] = -1;
+	prev[i] = q->tail;
+	if (q->tail != -1)
+	{
+		next[q->tail] = i;
+	}
+	else
+	{
+		q->head = i;
+	}
+	q->tail = i;
+	q->size += 1;
+}
+
+// Dequeue function to remove the index at the beginning of the queue, -1 if empty //
+int index_dequeue(index_queue *q, int *next, int *prev)
+{
+	int i = q->head;
+	if (i != -1)
+		index_remove(q, next, prev, i);
+	return i;
+}
+
+// Remove index i from anywhere in the queue //
+void index_remove(index_queue *q, int *next, int *prev, int i)
+{
+	if (prev[i] != -1)
+		next[prev[i]] = next[i];
+	else
+		q->head = next[i];
+	if (next[i] != -1)
+		prev[next[i]] = prev[i];
+	else
+		q->tail = prev[i];
+	q->size--;
+}
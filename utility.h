@@ -35,4 +35,22 @@ queue *create_queue();
 void enqueue(queue *q, void *data);
 void *dequeue(queue *q);
 
+// Index Queue Implementation //
+
+// Queue of array indices, linked through next/prev arrays owned by the caller
+// so that queued items need no allocation of their own
+struct index_queue_s
+{
+	int head;
+	int tail;
+	int size;
+};
+
+typedef struct index_queue_s index_queue;
+
+void init_index_queue(index_queue *q);
+void index_enqueue(index_queue *q, int *next, int *prev, int i);
+int index_dequeue(index_queue *q, int *next, int *prev);
+void index_remove(index_queue *q, int *next, int *prev, int i);
+
 #endif
\ No newline at end of file